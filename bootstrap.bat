@@ -5,6 +5,7 @@ call bootstrap-vcpkg.bat || goto :error
 vcpkg.exe install ^
     glfw3:x64-windows-static ^
     glm:x64-windows-static ^
+    zlib:x64-windows-static ^
     || goto :error
 popd
 
@@ -1,13 +1,31 @@
-﻿#include <cstdint>
+﻿#include <algorithm>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <mutex>
 #include <optional>
+#include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+#include <zlib.h>
+
 #include "main.hpp"
+#include "trace.hpp"
 
 #if (VULKAN_HPP_DISPATCH_LOADER_DYNAMIC == 1)
 VULKAN_HPP_DEFAULT_DISPATCH_LOADER_DYNAMIC_STORAGE
@@ -20,6 +38,58 @@ char const *APP_NAME = "Mini Renderer";
 uint32_t const APP_VERSION = 1;
 uint32_t const REQUIRED_VULKAN_VERSION = VK_API_VERSION_1_2;
 
+// Each frame in flight owns a readback buffer, which is only read once its fence has been waited
+// on again, so the GPU is never stalled to map the previous frame.
+uint32_t const MAX_FRAMES_IN_FLIGHT = 3;
+
+// Captured frames that have not yet been written to disk are dropped, rather than stalling
+// rendering, once this many are queued.
+size_t const MAX_QUEUED_CAPTURE_FRAMES = 8;
+
+// Y4M video is resampled to this constant rate using the time each frame was submitted, so the
+// video stays in time with what was rendered regardless of dropped frames or the present rate.
+uint32_t const CAPTURE_FRAME_RATE = 60;
+
+// The scene is rendered at a fraction of the swapchain resolution, which is adjusted every frame
+// to keep the measured GPU frame time within budget, and then upscaled to the swapchain image.
+double const FRAME_TIME_BUDGET = 1000.0 / 60.0;
+double const FRAME_TIME_HIGH = 0.95 * FRAME_TIME_BUDGET;
+double const FRAME_TIME_LOW = 0.80 * FRAME_TIME_BUDGET;
+double const FRAME_TIME_SMOOTHING = 0.2;
+uint32_t const RENDER_SCALE_INCREASE_DELAY = 30;
+float const RENDER_SCALE_GAIN = 0.5f;
+float const MIN_RENDER_SCALE = 0.5f;
+float const MAX_RENDER_SCALE = 1.0f;
+
+// The scene pass and the upscale are timed separately, so that the time the upscale spends
+// waiting for the swapchain image isn't counted as rendering time.
+uint32_t const TIMESTAMPS_PER_FRAME = 4;
+
+#if defined(MINI_RENDERER_TRACE)
+// GPU timestamps are placed on the trace timeline using calibrated timestamps, which are refreshed
+// periodically to account for drift between the clocks.
+uint32_t const TIMESTAMP_CALIBRATION_INTERVAL = 120;
+
+#if defined(_WIN32)
+vk::TimeDomainEXT const HOST_TIME_DOMAIN = vk::TimeDomainEXT::eQueryPerformanceCounter;
+#else
+vk::TimeDomainEXT const HOST_TIME_DOMAIN = vk::TimeDomainEXT::eClockMonotonic;
+#endif
+#endif
+
+enum class CaptureFormat {
+    eNone,
+    ePng,
+    eExr,
+    eY4m,
+};
+
+struct CaptureFrame {
+    uint64_t index;
+    uint64_t streamFrame;
+    std::vector<uint8_t> pixels;
+};
+
 // The order of declaration determines the order that destructors are invoked, which is important
 // for safe destruction of resources. I beleive in a single compilation unit this order is
 // well-defined, however it will always be better to wrap these variables in a struct or class or
@@ -32,21 +102,69 @@ std::optional<vk::UniqueDebugUtilsMessengerEXT> debugMessenger;
 vk::UniqueSurfaceKHR surface;
 vk::PhysicalDevice physicalDevice;
 uint32_t queueFamilyIndex;
+std::vector<char const *> enabledDeviceExtensions;
 vk::UniqueDevice device;
 vk::Queue queue;
 vk::SurfaceCapabilitiesKHR surfaceCapabilities;
 vk::Format swapchainFormat;
 vk::Extent2D swapchainExtent;
 vk::UniqueSwapchainKHR swapchain;
-std::vector<vk::UniqueImageView> swapchainImageViews;
+std::vector<vk::Image> swapchainImages;
+std::vector<vk::UniqueDeviceMemory> sceneMemories;
+std::vector<vk::UniqueImage> sceneImages;
+std::vector<vk::UniqueImageView> sceneImageViews;
 vk::UniqueRenderPass renderPass;
 vk::UniquePipelineLayout pipelineLayout;
 vk::UniquePipeline pipeline;
-std::vector<vk::UniqueFramebuffer> swapchainFramebuffers;
+std::vector<vk::UniqueFramebuffer> sceneFramebuffers;
 vk::UniqueCommandPool commandPool;
 std::vector<vk::UniqueCommandBuffer> commandBuffers;
-vk::UniqueSemaphore imageAvailable;
-vk::UniqueSemaphore renderFinished;
+vk::UniqueQueryPool timestampQueryPool;
+std::vector<vk::UniqueSemaphore> imageAvailableSemaphores;
+std::vector<vk::UniqueSemaphore> renderFinishedSemaphores;
+std::vector<vk::UniqueFence> inFlightFences;
+uint32_t currentFrame = 0;
+uint64_t frameIndex = 0;
+
+bool hasTimestamps;
+double timestampPeriod;
+std::vector<bool> timestampFrames;
+std::vector<float> timestampScales;
+std::optional<double> gpuFrameTime;
+std::optional<double> gpuUpscaleTime;
+uint32_t framesUnderBudget = 0;
+float renderScale = MAX_RENDER_SCALE;
+
+#if defined(MINI_RENDERER_TRACE)
+std::string tracePath;
+bool hasCalibratedTimestamps = false;
+uint64_t calibratedGpuTimestamp;
+uint64_t calibratedHostTime;
+#endif
+
+CaptureFormat captureFormat = CaptureFormat::eNone;
+std::string capturePath;
+bool captureSwizzle;
+vk::DeviceSize readbackSize;
+bool readbackCoherent;
+std::vector<vk::UniqueBuffer> readbackBuffers;
+std::vector<vk::UniqueDeviceMemory> readbackMemories;
+std::vector<uint8_t const *> readbackMappings;
+std::vector<std::optional<uint64_t>> readbackFrames;
+std::vector<std::chrono::steady_clock::time_point> readbackTimes;
+std::ofstream captureStream;
+std::optional<std::chrono::steady_clock::time_point> captureStreamStart;
+uint64_t captureClaimedStreamFrames = 0;
+uint64_t captureStreamFrames = 0;
+std::vector<uint8_t> captureStreamPlanes;
+std::mutex captureMutex;
+std::condition_variable_any captureCondition;
+std::deque<CaptureFrame> captureQueue;
+std::vector<std::vector<uint8_t>> capturePixelPool;
+bool captureFinished = false;
+bool captureFailed = false;
+uint64_t captureDroppedFrames = 0;
+std::jthread captureThread;
 
 std::vector<char> readBytes(std::string const &filePath)
 {
@@ -72,6 +190,8 @@ VKAPI_ATTR VkBool32 VKAPI_CALL debugCallback(
 
 void createWindow(char const *title, uint32_t width, uint32_t height)
 {
+    TRACE_FUNCTION();
+
     glfwInit();
     glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
     glfwWindowHint(GLFW_RESIZABLE, GLFW_FALSE);
@@ -97,6 +217,8 @@ void createInstance(
     uint32_t requiredVulkanVersion,
     std::vector<char const *> requiredExtensions)
 {
+    TRACE_FUNCTION();
+
     uint32_t requiredMajor = VK_VERSION_MAJOR(requiredVulkanVersion);
     uint32_t requiredMinor = VK_VERSION_MINOR(requiredVulkanVersion);
 
@@ -181,6 +303,8 @@ void createInstance(
 
 void createSurface()
 {
+    TRACE_FUNCTION();
+
     VkSurfaceKHR _surface;
     if (glfwCreateWindowSurface(*instance, window, nullptr, &_surface) != VK_SUCCESS) {
         throw std::runtime_error("could not create window surface");
@@ -191,12 +315,16 @@ void createSurface()
 
 void choosePhysicalDevice()
 {
+    TRACE_FUNCTION();
+
     auto physicalDevices = instance->enumeratePhysicalDevices();
     physicalDevice = physicalDevices.front();
 }
 
 void chooseQueueFamily()
 {
+    TRACE_FUNCTION();
+
     auto queueFamilies = physicalDevice.getQueueFamilyProperties();
 
     for (size_t i = 0; i < queueFamilies.size(); i++) {
@@ -214,24 +342,46 @@ void chooseQueueFamily()
     throw std::runtime_error("could not find queue family that supports graphics and presentation");
 }
 
-void createDevice(std::vector<char const *> requiredExtensions)
+bool hasDeviceExtension(char const *extension)
+{
+    for (auto const enabledExtension : enabledDeviceExtensions) {
+        if (strcmp(extension, enabledExtension) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Optional extensions are enabled when available, use hasDeviceExtension() to check for them.
+void createDevice(
+    std::vector<char const *> requiredExtensions, std::vector<char const *> optionalExtensions)
 {
+    TRACE_FUNCTION();
+
     std::vector<char const *> enabledExtensions(requiredExtensions);
 
     auto availableExtensions = physicalDevice.enumerateDeviceExtensionProperties();
-    for (auto const enabledExtension : enabledExtensions) {
-        auto hasEnabledExtension = false;
+    auto isAvailable = [&](char const *extension) {
         for (auto const availableExtension : availableExtensions) {
-            if (strcmp(enabledExtension, availableExtension.extensionName) == 0) {
-                hasEnabledExtension = true;
-                break;
+            if (strcmp(extension, availableExtension.extensionName) == 0) {
+                return true;
             }
         }
-        if (!hasEnabledExtension) {
+        return false;
+    };
+
+    for (auto const enabledExtension : enabledExtensions) {
+        if (!isAvailable(enabledExtension)) {
             throw std::runtime_error("could not find all required device extensions");
         }
     }
 
+    for (auto const optionalExtension : optionalExtensions) {
+        if (isAvailable(optionalExtension)) {
+            enabledExtensions.push_back(optionalExtension);
+        }
+    }
+
     float queuePriority = 1.0;
     vk::DeviceQueueCreateInfo queueCreateInfo{
         .queueFamilyIndex = queueFamilyIndex,
@@ -251,6 +401,7 @@ void createDevice(std::vector<char const *> requiredExtensions)
     };
 
     device = physicalDevice.createDeviceUnique(deviceCreateInfo);
+    enabledDeviceExtensions = enabledExtensions;
 
 #if (VULKAN_HPP_DISPATCH_LOADER_DYNAMIC == 1)
     VULKAN_HPP_DEFAULT_DISPATCHER.init(*device);
@@ -261,6 +412,8 @@ void createDevice(std::vector<char const *> requiredExtensions)
 
 void createSwapchain()
 {
+    TRACE_FUNCTION();
+
     surfaceCapabilities = physicalDevice.getSurfaceCapabilitiesKHR(*surface);
 
     uint32_t imageCount = surfaceCapabilities.minImageCount + 1;
@@ -316,6 +469,19 @@ void createSwapchain()
         }
     }
 
+    // The scene is upscaled into the swapchain image with a blit, rather than rendered to it.
+    if (!(surfaceCapabilities.supportedUsageFlags & vk::ImageUsageFlagBits::eTransferDst)) {
+        throw std::runtime_error("could not find surface support for blitting to swapchain images");
+    }
+
+    vk::ImageUsageFlags swapchainUsage = vk::ImageUsageFlagBits::eTransferDst;
+    if (captureFormat != CaptureFormat::eNone) {
+        if (!(surfaceCapabilities.supportedUsageFlags & vk::ImageUsageFlagBits::eTransferSrc)) {
+            throw std::runtime_error("could not find surface support for copying swapchain images");
+        }
+        swapchainUsage |= vk::ImageUsageFlagBits::eTransferSrc;
+    }
+
     vk::SwapchainCreateInfoKHR swapchainCreateInfo{
         .surface = *surface,
         .minImageCount = imageCount,
@@ -323,7 +489,7 @@ void createSwapchain()
         .imageColorSpace = swapchainColorSpace,
         .imageExtent = swapchainExtent,
         .imageArrayLayers = 1,
-        .imageUsage = vk::ImageUsageFlagBits::eColorAttachment,
+        .imageUsage = swapchainUsage,
         .imageSharingMode = vk::SharingMode::eExclusive,
         .preTransform = surfaceCapabilities.currentTransform,
         .presentMode = swapchainPresentMode,
@@ -331,16 +497,79 @@ void createSwapchain()
     };
 
     swapchain = device->createSwapchainKHRUnique(swapchainCreateInfo);
+    swapchainImages = device->getSwapchainImagesKHR(*swapchain);
+}
+
+std::optional<uint32_t> findMemoryType(uint32_t memoryTypeBits, vk::MemoryPropertyFlags properties)
+{
+    auto memoryProperties = physicalDevice.getMemoryProperties();
+
+    for (uint32_t i = 0; i < memoryProperties.memoryTypeCount; i++) {
+        bool isAllowed = memoryTypeBits & (1 << i);
+        bool hasProperties =
+            (memoryProperties.memoryTypes[i].propertyFlags & properties) == properties;
+
+        if (isAllowed && hasProperties) {
+            return i;
+        }
+    }
+
+    return std::nullopt;
 }
 
-void createImageViews()
+void createSceneImages()
 {
-    auto swapchainImages = device->getSwapchainImagesKHR(*swapchain);
+    TRACE_FUNCTION();
+
+    auto formatProperties = physicalDevice.getFormatProperties(swapchainFormat);
+    vk::FormatFeatureFlags requiredFeatures = vk::FormatFeatureFlagBits::eColorAttachment
+        | vk::FormatFeatureFlagBits::eBlitSrc | vk::FormatFeatureFlagBits::eBlitDst
+        | vk::FormatFeatureFlagBits::eSampledImageFilterLinear;
+    if ((formatProperties.optimalTilingFeatures & requiredFeatures) != requiredFeatures) {
+        throw std::runtime_error("could not find support for upscaling the swapchain format");
+    }
+
+    // Each frame in flight renders into its own scene image, so reusing one is guarded by the
+    // frame fence rather than by a dependency on the previous frame's upscale. The images are
+    // allocated at the full swapchain resolution, so the render scale can change every frame
+    // without recreating them.
+    vk::ImageCreateInfo imageCreateInfo{
+        .imageType = vk::ImageType::e2D,
+        .format = swapchainFormat,
+        .extent = {swapchainExtent.width, swapchainExtent.height, 1},
+        .mipLevels = 1,
+        .arrayLayers = 1,
+        .samples = vk::SampleCountFlagBits::e1,
+        .tiling = vk::ImageTiling::eOptimal,
+        .usage = vk::ImageUsageFlagBits::eColorAttachment | vk::ImageUsageFlagBits::eTransferSrc,
+        .sharingMode = vk::SharingMode::eExclusive,
+        .initialLayout = vk::ImageLayout::eUndefined,
+    };
+
+    sceneMemories.resize(MAX_FRAMES_IN_FLIGHT);
+    sceneImages.resize(MAX_FRAMES_IN_FLIGHT);
+    sceneImageViews.resize(MAX_FRAMES_IN_FLIGHT);
+
+    for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+        sceneImages[i] = device->createImageUnique(imageCreateInfo);
+
+        auto memoryRequirements = device->getImageMemoryRequirements(*sceneImages[i]);
+        auto memoryTypeIndex = findMemoryType(
+            memoryRequirements.memoryTypeBits, vk::MemoryPropertyFlagBits::eDeviceLocal);
+        if (!memoryTypeIndex) {
+            throw std::runtime_error("could not find device local memory for the scene image");
+        }
+
+        vk::MemoryAllocateInfo memoryAllocateInfo{
+            .allocationSize = memoryRequirements.size,
+            .memoryTypeIndex = *memoryTypeIndex,
+        };
+
+        sceneMemories[i] = device->allocateMemoryUnique(memoryAllocateInfo);
+        device->bindImageMemory(*sceneImages[i], *sceneMemories[i], 0);
 
-    swapchainImageViews = std::vector<vk::UniqueImageView>(swapchainImages.size());
-    for (size_t i = 0; i < swapchainImages.size(); i++) {
         vk::ImageViewCreateInfo imageViewCreateInfo{
-            .image = swapchainImages[i],
+            .image = *sceneImages[i],
             .viewType = vk::ImageViewType::e2D,
             .format = swapchainFormat,
             .subresourceRange =
@@ -353,12 +582,14 @@ void createImageViews()
                 },
         };
 
-        swapchainImageViews[i] = device->createImageViewUnique(imageViewCreateInfo);
+        sceneImageViews[i] = device->createImageViewUnique(imageViewCreateInfo);
     }
 }
 
 void createRenderPass()
 {
+    TRACE_FUNCTION();
+
     vk::AttachmentDescription colorAttachment{
         .format = swapchainFormat,
         .samples = vk::SampleCountFlagBits::e1,
@@ -367,7 +598,7 @@ void createRenderPass()
         .stencilLoadOp = vk::AttachmentLoadOp::eDontCare,
         .stencilStoreOp = vk::AttachmentStoreOp::eDontCare,
         .initialLayout = vk::ImageLayout::eUndefined,
-        .finalLayout = vk::ImageLayout::ePresentSrcKHR,
+        .finalLayout = vk::ImageLayout::eTransferSrcOptimal,
     };
 
     vk::AttachmentReference colorAttachmentReference{
@@ -381,13 +612,26 @@ void createRenderPass()
         .pColorAttachments = &colorAttachmentReference,
     };
 
-    vk::SubpassDependency subpassDependency{
-        .srcSubpass = VK_SUBPASS_EXTERNAL,
-        .dstSubpass = 0,
-        .srcStageMask = vk::PipelineStageFlagBits::eColorAttachmentOutput,
-        .dstStageMask = vk::PipelineStageFlagBits::eColorAttachmentOutput,
-        //.srcAccessMask = {},
-        .dstAccessMask = vk::AccessFlagBits::eColorAttachmentWrite,
+    // The upscale blit must wait for the scene to be rendered. Reusing a scene image is guarded by
+    // the frame fence, so the external source stage must not include the transfer stage, which
+    // would chain the scene pass to the acquire semaphore.
+    std::vector<vk::SubpassDependency> subpassDependencies{
+        vk::SubpassDependency{
+            .srcSubpass = VK_SUBPASS_EXTERNAL,
+            .dstSubpass = 0,
+            .srcStageMask = vk::PipelineStageFlagBits::eColorAttachmentOutput,
+            .dstStageMask = vk::PipelineStageFlagBits::eColorAttachmentOutput,
+            //.srcAccessMask = {},
+            .dstAccessMask = vk::AccessFlagBits::eColorAttachmentWrite,
+        },
+        vk::SubpassDependency{
+            .srcSubpass = 0,
+            .dstSubpass = VK_SUBPASS_EXTERNAL,
+            .srcStageMask = vk::PipelineStageFlagBits::eColorAttachmentOutput,
+            .dstStageMask = vk::PipelineStageFlagBits::eTransfer,
+            .srcAccessMask = vk::AccessFlagBits::eColorAttachmentWrite,
+            .dstAccessMask = vk::AccessFlagBits::eTransferRead,
+        },
     };
 
     vk::RenderPassCreateInfo renderPassCreateInfo{
@@ -395,8 +639,8 @@ void createRenderPass()
         .pAttachments = &colorAttachment,
         .subpassCount = 1,
         .pSubpasses = &subpass,
-        .dependencyCount = 1,
-        .pDependencies = &subpassDependency,
+        .dependencyCount = static_cast<uint32_t>(subpassDependencies.size()),
+        .pDependencies = subpassDependencies.data(),
     };
 
     renderPass = device->createRenderPassUnique(renderPassCreateInfo);
@@ -404,6 +648,8 @@ void createRenderPass()
 
 void createGraphicsPipeline()
 {
+    TRACE_FUNCTION();
+
     auto vertexShaderBytes = readBytes("../resources/shader.vert.spv");
     vk::ShaderModuleCreateInfo vertexShaderCreateInfo{
         .codeSize = vertexShaderBytes.size(),
@@ -447,25 +693,12 @@ void createGraphicsPipeline()
         .primitiveRestartEnable = VK_FALSE,
     };
 
-    vk::Viewport viewport{
-        .x = 0.0f,
-        .y = 0.0f,
-        .width = static_cast<float>(swapchainExtent.width),
-        .height = static_cast<float>(swapchainExtent.height),
-        .minDepth = 0.0f,
-        .maxDepth = 1.0f,
-    };
-
-    vk::Rect2D scissor{
-        .offset = {0, 0},
-        .extent = swapchainExtent,
-    };
-
+    // The viewport and scissor follow the render scale, so they are set when recording.
     vk::PipelineViewportStateCreateInfo viewportState{
         .viewportCount = 1,
-        .pViewports = &viewport,
+        //.pViewports = nullptr,
         .scissorCount = 1,
-        .pScissors = &scissor,
+        //.pScissors = nullptr,
     };
 
     vk::PipelineRasterizationStateCreateInfo rasterizationState{
@@ -519,6 +752,16 @@ void createGraphicsPipeline()
 
     pipelineLayout = device->createPipelineLayoutUnique(pipelineLayoutCreateInfo);
 
+    std::vector<vk::DynamicState> dynamicStates{
+        vk::DynamicState::eViewport,
+        vk::DynamicState::eScissor,
+    };
+
+    vk::PipelineDynamicStateCreateInfo dynamicState{
+        .dynamicStateCount = static_cast<uint32_t>(dynamicStates.size()),
+        .pDynamicStates = dynamicStates.data(),
+    };
+
     vk::GraphicsPipelineCreateInfo graphicsPipelineCreateInfo{
         .stageCount = static_cast<uint32_t>(shaderStages.size()),
         .pStages = shaderStages.data(),
@@ -529,7 +772,7 @@ void createGraphicsPipeline()
         .pMultisampleState = &multisampleState,
         //.pDepthStencilState = nullptr,
         .pColorBlendState = &colorBlendState,
-        //.pDynamicState = nullptr,
+        .pDynamicState = &dynamicState,
         .layout = *pipelineLayout,
         .renderPass = *renderPass,
         .subpass = 0,
@@ -542,24 +785,29 @@ void createGraphicsPipeline()
 
 void createFramebuffers()
 {
-    swapchainFramebuffers.resize(swapchainImageViews.size());
-    for (size_t i = 0; i < swapchainFramebuffers.size(); i++) {
+    TRACE_FUNCTION();
+
+    sceneFramebuffers.resize(sceneImageViews.size());
+    for (size_t i = 0; i < sceneFramebuffers.size(); i++) {
         vk::FramebufferCreateInfo frameBufferCreateInfo{
             .renderPass = *renderPass,
             .attachmentCount = 1,
-            .pAttachments = &*swapchainImageViews[i],
+            .pAttachments = &*sceneImageViews[i],
             .width = swapchainExtent.width,
             .height = swapchainExtent.height,
             .layers = 1,
         };
 
-        swapchainFramebuffers[i] = device->createFramebufferUnique(frameBufferCreateInfo);
+        sceneFramebuffers[i] = device->createFramebufferUnique(frameBufferCreateInfo);
     }
 }
 
 void createCommandPool()
 {
+    TRACE_FUNCTION();
+
     vk::CommandPoolCreateInfo commandPoolCreateInfo{
+        .flags = vk::CommandPoolCreateFlagBits::eResetCommandBuffer,
         .queueFamilyIndex = queueFamilyIndex,
     };
 
@@ -568,86 +816,1082 @@ void createCommandPool()
 
 void createCommandBuffers()
 {
-    commandBuffers.resize(swapchainFramebuffers.size());
+    TRACE_FUNCTION();
 
+    // Command buffers are recorded every frame, since the render area follows the render scale.
     vk::CommandBufferAllocateInfo commandBufferAllocateInfo{
         .commandPool = *commandPool,
         .level = vk::CommandBufferLevel::ePrimary,
-        .commandBufferCount = static_cast<uint32_t>(commandBuffers.size()),
+        .commandBufferCount = MAX_FRAMES_IN_FLIGHT,
     };
 
     commandBuffers = device->allocateCommandBuffersUnique(commandBufferAllocateInfo);
+}
 
-    for (size_t i = 0; i < commandBuffers.size(); i++) {
-        vk::CommandBufferBeginInfo commandBufferBeginInfo{
-            //.pInheritanceInfo = nullptr,
-        };
+#if defined(MINI_RENDERER_TRACE)
+void calibrateTimestamps()
+{
+    std::array<vk::CalibratedTimestampInfoEXT, 2> timestampInfos{
+        vk::CalibratedTimestampInfoEXT{
+            .timeDomain = vk::TimeDomainEXT::eDevice,
+        },
+        vk::CalibratedTimestampInfoEXT{
+            .timeDomain = HOST_TIME_DOMAIN,
+        },
+    };
 
-        commandBuffers[i]->begin(commandBufferBeginInfo);
+    std::array<uint64_t, 2> timestamps;
+    uint64_t maxDeviation;
+    auto result = device->getCalibratedTimestampsEXT(
+        static_cast<uint32_t>(timestampInfos.size()),
+        timestampInfos.data(),
+        timestamps.data(),
+        &maxDeviation);
+    if (result != vk::Result::eSuccess) {
+        throw std::runtime_error("could not calibrate timestamps");
+    }
 
-        vk::ClearValue clearColor = vk::ClearValue{std::array<float, 4>{0.0f, 0.0f, 0.0f, 1.0f}};
+    calibratedGpuTimestamp = timestamps[0];
+    calibratedHostTime = convertTraceHostTimestamp(timestamps[1]);
+}
 
-        vk::RenderPassBeginInfo renderPassBeginInfo{
-            .renderPass = *renderPass,
-            .framebuffer = *swapchainFramebuffers[i],
-            .renderArea =
-                vk::Rect2D{
-                    .offset = {0, 0},
-                    .extent = swapchainExtent,
-                },
-            .clearValueCount = 1,
-            .pClearValues = &clearColor,
+void traceGpuFrame(std::array<uint64_t, TIMESTAMPS_PER_FRAME> const &timestamps)
+{
+    if (!hasCalibratedTimestamps) {
+        return;
+    }
+
+    if (frameIndex % TIMESTAMP_CALIBRATION_INTERVAL == 0) {
+        calibrateTimestamps();
+    }
+
+    auto convertTimestamp = [](uint64_t timestamp) {
+        auto elapsedTimestamp = static_cast<int64_t>(timestamp - calibratedGpuTimestamp);
+        return calibratedHostTime + static_cast<int64_t>(elapsedTimestamp * timestampPeriod);
+    };
+
+    recordTraceGpuZone("scene", convertTimestamp(timestamps[0]), convertTimestamp(timestamps[1]));
+    recordTraceGpuZone("upscale", convertTimestamp(timestamps[2]), convertTimestamp(timestamps[3]));
+}
+#endif
+
+void createTimestampQueryPool()
+{
+    TRACE_FUNCTION();
+
+    auto properties = physicalDevice.getProperties();
+    auto queueFamilies = physicalDevice.getQueueFamilyProperties();
+
+    hasTimestamps = queueFamilies[queueFamilyIndex].timestampValidBits > 0;
+    if (!hasTimestamps) {
+        std::cout << "could not find timestamp support, the render scale is fixed" << std::endl;
+        return;
+    }
+
+    timestampPeriod = properties.limits.timestampPeriod;
+    timestampFrames.resize(MAX_FRAMES_IN_FLIGHT);
+    timestampScales.resize(MAX_FRAMES_IN_FLIGHT);
+
+    vk::QueryPoolCreateInfo queryPoolCreateInfo{
+        .queryType = vk::QueryType::eTimestamp,
+        .queryCount = TIMESTAMPS_PER_FRAME * MAX_FRAMES_IN_FLIGHT,
+    };
+
+    timestampQueryPool = device->createQueryPoolUnique(queryPoolCreateInfo);
+
+#if defined(MINI_RENDERER_TRACE)
+    if (hasDeviceExtension(VK_EXT_CALIBRATED_TIMESTAMPS_EXTENSION_NAME)) {
+        auto timeDomains = physicalDevice.getCalibrateableTimeDomainsEXT();
+        bool hasDeviceDomain =
+            std::find(timeDomains.begin(), timeDomains.end(), vk::TimeDomainEXT::eDevice)
+            != timeDomains.end();
+        bool hasHostDomain =
+            std::find(timeDomains.begin(), timeDomains.end(), HOST_TIME_DOMAIN) != timeDomains.end();
+        hasCalibratedTimestamps = hasDeviceDomain && hasHostDomain;
+    }
+
+    if (hasCalibratedTimestamps) {
+        calibrateTimestamps();
+    } else {
+        std::cout << "could not find calibrated timestamp support, gpu zones are not traced"
+                  << std::endl;
+    }
+#endif
+}
+
+void createReadbackBuffers()
+{
+    TRACE_FUNCTION();
+
+    if (captureFormat == CaptureFormat::eNone) {
+        return;
+    }
+
+    switch (swapchainFormat) {
+    case vk::Format::eB8G8R8A8Srgb:
+    case vk::Format::eB8G8R8A8Unorm:
+        captureSwizzle = true;
+        break;
+    case vk::Format::eR8G8B8A8Srgb:
+    case vk::Format::eR8G8B8A8Unorm:
+        captureSwizzle = false;
+        break;
+    default:
+        throw std::runtime_error("could not capture the swapchain format");
+    }
+
+    readbackSize = static_cast<vk::DeviceSize>(swapchainExtent.width) * swapchainExtent.height * 4;
+
+    readbackBuffers.resize(MAX_FRAMES_IN_FLIGHT);
+    readbackMemories.resize(MAX_FRAMES_IN_FLIGHT);
+    readbackMappings.resize(MAX_FRAMES_IN_FLIGHT);
+    readbackFrames.resize(MAX_FRAMES_IN_FLIGHT);
+    readbackTimes.resize(MAX_FRAMES_IN_FLIGHT);
+
+    for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+        vk::BufferCreateInfo bufferCreateInfo{
+            .size = readbackSize,
+            .usage = vk::BufferUsageFlagBits::eTransferDst,
+            .sharingMode = vk::SharingMode::eExclusive,
+        };
+
+        readbackBuffers[i] = device->createBufferUnique(bufferCreateInfo);
+
+        auto memoryRequirements = device->getBufferMemoryRequirements(*readbackBuffers[i]);
+
+        // Cached memory is much faster to read from the CPU, but may not be coherent.
+        auto memoryTypeIndex = findMemoryType(
+            memoryRequirements.memoryTypeBits,
+            vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCached);
+        readbackCoherent = false;
+        if (!memoryTypeIndex) {
+            memoryTypeIndex = findMemoryType(
+                memoryRequirements.memoryTypeBits,
+                vk::MemoryPropertyFlagBits::eHostVisible
+                    | vk::MemoryPropertyFlagBits::eHostCoherent);
+            readbackCoherent = true;
+        }
+        if (!memoryTypeIndex) {
+            throw std::runtime_error("could not find host visible memory for readback");
+        }
+
+        vk::MemoryAllocateInfo memoryAllocateInfo{
+            .allocationSize = memoryRequirements.size,
+            .memoryTypeIndex = *memoryTypeIndex,
         };
 
-        commandBuffers[i]->beginRenderPass(renderPassBeginInfo, vk::SubpassContents::eInline);
-        commandBuffers[i]->bindPipeline(vk::PipelineBindPoint::eGraphics, *pipeline);
-        commandBuffers[i]->draw(3, 1, 0, 0);
-        commandBuffers[i]->endRenderPass();
-        commandBuffers[i]->end();
+        readbackMemories[i] = device->allocateMemoryUnique(memoryAllocateInfo);
+        device->bindBufferMemory(*readbackBuffers[i], *readbackMemories[i], 0);
+
+        // The memory stays mapped for the lifetime of the buffer and is implicitly unmapped when
+        // it is freed.
+        readbackMappings[i] = static_cast<uint8_t const *>(
+            device->mapMemory(*readbackMemories[i], 0, VK_WHOLE_SIZE));
     }
 }
 
-void createSemaphores()
+void createSyncObjects()
 {
+    TRACE_FUNCTION();
+
     vk::SemaphoreCreateInfo semaphoreCreateInfo;
-    imageAvailable = device->createSemaphoreUnique(semaphoreCreateInfo);
-    renderFinished = device->createSemaphoreUnique(semaphoreCreateInfo);
+
+    vk::FenceCreateInfo fenceCreateInfo{
+        .flags = vk::FenceCreateFlagBits::eSignaled,
+    };
+
+    imageAvailableSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
+    renderFinishedSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
+    inFlightFences.resize(MAX_FRAMES_IN_FLIGHT);
+
+    for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+        imageAvailableSemaphores[i] = device->createSemaphoreUnique(semaphoreCreateInfo);
+        renderFinishedSemaphores[i] = device->createSemaphoreUnique(semaphoreCreateInfo);
+        inFlightFences[i] = device->createFenceUnique(fenceCreateInfo);
+    }
+}
+
+// Converts tightly packed 8-bit pixels to RGBA, swapping the red and blue channels of BGRA input.
+void convertPixels(uint8_t const *source, uint8_t *destination, size_t pixelCount, bool swizzle)
+{
+    if (!swizzle) {
+        memcpy(destination, source, pixelCount * 4);
+        return;
+    }
+
+    size_t i = 0;
+
+#if defined(__SSE2__) || defined(_M_X64)
+    __m128i const greenAlphaMask = _mm_set1_epi32(static_cast<int>(0xFF00FF00));
+    for (; i + 4 <= pixelCount; i += 4) {
+        __m128i pixels = _mm_loadu_si128(reinterpret_cast<__m128i const *>(source + i * 4));
+        __m128i greenAlpha = _mm_and_si128(pixels, greenAlphaMask);
+        __m128i blueRed = _mm_andnot_si128(greenAlphaMask, pixels);
+        __m128i redBlue = _mm_or_si128(_mm_slli_epi32(blueRed, 16), _mm_srli_epi32(blueRed, 16));
+        _mm_storeu_si128(
+            reinterpret_cast<__m128i *>(destination + i * 4), _mm_or_si128(greenAlpha, redBlue));
+    }
+#endif
+
+    for (; i < pixelCount; i++) {
+        destination[i * 4 + 0] = source[i * 4 + 2];
+        destination[i * 4 + 1] = source[i * 4 + 1];
+        destination[i * 4 + 2] = source[i * 4 + 0];
+        destination[i * 4 + 3] = source[i * 4 + 3];
+    }
+}
+
+void appendBigEndian(std::vector<uint8_t> &bytes, uint32_t value)
+{
+    bytes.push_back(static_cast<uint8_t>(value >> 24));
+    bytes.push_back(static_cast<uint8_t>(value >> 16));
+    bytes.push_back(static_cast<uint8_t>(value >> 8));
+    bytes.push_back(static_cast<uint8_t>(value));
+}
+
+template <typename T> void appendLittleEndian(std::vector<uint8_t> &bytes, T value)
+{
+    uint8_t valueBytes[sizeof(T)];
+    memcpy(valueBytes, &value, sizeof(T));
+    bytes.insert(bytes.end(), valueBytes, valueBytes + sizeof(T));
+}
+
+void appendString(std::vector<uint8_t> &bytes, char const *string)
+{
+    bytes.insert(bytes.end(), string, string + strlen(string) + 1);
+}
+
+void writeBytes(std::string const &filePath, std::vector<uint8_t> const &bytes)
+{
+    std::ofstream file(filePath, std::ios::binary);
+    if (!file.is_open()) {
+        throw std::runtime_error("could not open file");
+    }
+
+    file.write(reinterpret_cast<char const *>(bytes.data()), bytes.size());
+    if (!file) {
+        throw std::runtime_error("could not write file");
+    }
+}
+
+void appendPngChunk(std::vector<uint8_t> &bytes, char const *type, std::vector<uint8_t> const &data)
+{
+    appendBigEndian(bytes, static_cast<uint32_t>(data.size()));
+    bytes.insert(bytes.end(), type, type + 4);
+    bytes.insert(bytes.end(), data.begin(), data.end());
+
+    uLong crc = crc32(0, reinterpret_cast<Bytef const *>(type), 4);
+    // A null buffer would reset the checksum, which is what an empty vector may return.
+    if (!data.empty()) {
+        crc = crc32(crc, data.data(), static_cast<uInt>(data.size()));
+    }
+    appendBigEndian(bytes, static_cast<uint32_t>(crc));
+}
+
+void writePng(
+    std::string const &filePath, uint32_t width, uint32_t height, std::vector<uint8_t> const &pixels)
+{
+    // Every row except the first uses the up filter, which is cheap to vectorize and usually
+    // compresses rendered images far better than no filter at all.
+    size_t rowSize = static_cast<size_t>(width) * 4;
+    std::vector<uint8_t> filtered((rowSize + 1) * height);
+    for (size_t y = 0; y < height; y++) {
+        uint8_t const *row = pixels.data() + y * rowSize;
+        uint8_t *filteredRow = filtered.data() + y * (rowSize + 1);
+
+        if (y == 0) {
+            filteredRow[0] = 0;
+            memcpy(filteredRow + 1, row, rowSize);
+            continue;
+        }
+
+        uint8_t const *previousRow = row - rowSize;
+        filteredRow[0] = 2;
+        for (size_t x = 0; x < rowSize; x++) {
+            filteredRow[x + 1] = static_cast<uint8_t>(row[x] - previousRow[x]);
+        }
+    }
+
+    uLongf compressedSize = compressBound(static_cast<uLong>(filtered.size()));
+    std::vector<uint8_t> compressed(compressedSize);
+    int result = compress2(
+        compressed.data(),
+        &compressedSize,
+        filtered.data(),
+        static_cast<uLong>(filtered.size()),
+        Z_BEST_SPEED);
+    if (result != Z_OK) {
+        throw std::runtime_error("could not compress png image");
+    }
+    compressed.resize(compressedSize);
+
+    std::vector<uint8_t> header;
+    appendBigEndian(header, width);
+    appendBigEndian(header, height);
+    header.push_back(8); // Bit depth.
+    header.push_back(6); // Color type, RGBA.
+    header.push_back(0); // Compression method.
+    header.push_back(0); // Filter method.
+    header.push_back(0); // Interlace method.
+
+    std::vector<uint8_t> bytes{0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    appendPngChunk(bytes, "IHDR", header);
+    appendPngChunk(bytes, "IDAT", compressed);
+    appendPngChunk(bytes, "IEND", {});
+
+    writeBytes(filePath, bytes);
+}
+
+uint16_t encodeHalf(float value)
+{
+    uint32_t bits = std::bit_cast<uint32_t>(value);
+    uint16_t sign = static_cast<uint16_t>((bits >> 16) & 0x8000);
+    int32_t exponent = static_cast<int32_t>((bits >> 23) & 0xFF) - 127 + 15;
+    uint32_t mantissa = bits & 0x7FFFFF;
+
+    if (exponent <= 0) {
+        if (exponent < -10) {
+            return sign;
+        }
+        mantissa |= 0x800000;
+        return sign | static_cast<uint16_t>(mantissa >> (14 - exponent));
+    }
+
+    if (exponent >= 31) {
+        return sign | 0x7C00;
+    }
+
+    return sign | static_cast<uint16_t>(exponent << 10) | static_cast<uint16_t>(mantissa >> 13);
+}
+
+void writeExr(
+    std::string const &filePath, uint32_t width, uint32_t height, std::vector<uint8_t> const &pixels)
+{
+    // The swapchain stores sRGB encoded values, but OpenEXR images are expected to be linear.
+    static std::array<uint16_t, 256> const linearTable = [] {
+        std::array<uint16_t, 256> table;
+        for (size_t i = 0; i < table.size(); i++) {
+            float value = static_cast<float>(i) / 255.0f;
+            value = value <= 0.04045f ? value / 12.92f
+                                      : std::pow((value + 0.055f) / 1.055f, 2.4f);
+            table[i] = encodeHalf(value);
+        }
+        return table;
+    }();
+
+    // Channels are stored in alphabetical order and the alpha channel is discarded.
+    std::array<char const *, 3> const channelNames{"B", "G", "R"};
+    std::array<size_t, 3> const channelOffsets{2, 1, 0};
+
+    std::vector<uint8_t> bytes;
+    appendLittleEndian<uint32_t>(bytes, 20000630);
+    appendLittleEndian<uint32_t>(bytes, 2);
+
+    appendString(bytes, "channels");
+    appendString(bytes, "chlist");
+    appendLittleEndian<int32_t>(bytes, 18 * static_cast<int32_t>(channelNames.size()) + 1);
+    for (auto const channelName : channelNames) {
+        appendString(bytes, channelName);
+        appendLittleEndian<int32_t>(bytes, 1); // Pixel type, half.
+        appendLittleEndian<uint32_t>(bytes, 0); // Linear flag and reserved bytes.
+        appendLittleEndian<int32_t>(bytes, 1); // Horizontal sampling.
+        appendLittleEndian<int32_t>(bytes, 1); // Vertical sampling.
+    }
+    bytes.push_back(0);
+
+    appendString(bytes, "compression");
+    appendString(bytes, "compression");
+    appendLittleEndian<int32_t>(bytes, 1);
+    bytes.push_back(0); // No compression.
+
+    for (auto const windowName : {"dataWindow", "displayWindow"}) {
+        appendString(bytes, windowName);
+        appendString(bytes, "box2i");
+        appendLittleEndian<int32_t>(bytes, 16);
+        appendLittleEndian<int32_t>(bytes, 0);
+        appendLittleEndian<int32_t>(bytes, 0);
+        appendLittleEndian<int32_t>(bytes, static_cast<int32_t>(width) - 1);
+        appendLittleEndian<int32_t>(bytes, static_cast<int32_t>(height) - 1);
+    }
+
+    appendString(bytes, "lineOrder");
+    appendString(bytes, "lineOrder");
+    appendLittleEndian<int32_t>(bytes, 1);
+    bytes.push_back(0); // Increasing y.
+
+    appendString(bytes, "pixelAspectRatio");
+    appendString(bytes, "float");
+    appendLittleEndian<int32_t>(bytes, 4);
+    appendLittleEndian<float>(bytes, 1.0f);
+
+    appendString(bytes, "screenWindowCenter");
+    appendString(bytes, "v2f");
+    appendLittleEndian<int32_t>(bytes, 8);
+    appendLittleEndian<float>(bytes, 0.0f);
+    appendLittleEndian<float>(bytes, 0.0f);
+
+    appendString(bytes, "screenWindowWidth");
+    appendString(bytes, "float");
+    appendLittleEndian<int32_t>(bytes, 4);
+    appendLittleEndian<float>(bytes, 1.0f);
+
+    bytes.push_back(0);
+
+    // Without compression each scanline is its own block, so the offset table can be computed
+    // up front.
+    uint32_t scanlineSize = static_cast<uint32_t>(channelNames.size()) * width * 2;
+    uint64_t scanlineOffset = bytes.size() + static_cast<uint64_t>(height) * 8;
+    for (uint32_t y = 0; y < height; y++) {
+        appendLittleEndian<uint64_t>(bytes, scanlineOffset + y * (8 + uint64_t{scanlineSize}));
+    }
+
+    bytes.reserve(bytes.size() + static_cast<size_t>(height) * (8 + scanlineSize));
+    for (uint32_t y = 0; y < height; y++) {
+        appendLittleEndian<int32_t>(bytes, static_cast<int32_t>(y));
+        appendLittleEndian<uint32_t>(bytes, scanlineSize);
+
+        uint8_t const *row = pixels.data() + static_cast<size_t>(y) * width * 4;
+        for (auto const channelOffset : channelOffsets) {
+            for (uint32_t x = 0; x < width; x++) {
+                appendLittleEndian<uint16_t>(bytes, linearTable[row[x * 4 + channelOffset]]);
+            }
+        }
+    }
+
+    writeBytes(filePath, bytes);
+}
+
+void writeY4mPlanes(std::ofstream &stream, std::vector<uint8_t> const &planes)
+{
+    stream << "FRAME\n";
+    stream.write(reinterpret_cast<char const *>(planes.data()), planes.size());
+    if (!stream) {
+        throw std::runtime_error("could not write y4m frame");
+    }
+}
+
+void writeY4mFrame(
+    std::ofstream &stream, uint32_t width, uint32_t height, CaptureFrame const &frame)
+{
+    // Repeat the previous frame for the stream frames that no rendered frame landed on, which
+    // includes the frames dropped when the capture thread falls behind.
+    for (; captureStreamFrames < frame.streamFrame; captureStreamFrames++) {
+        writeY4mPlanes(stream, captureStreamPlanes);
+    }
+
+    // Converts to 4:4:4 planar studio range BT.601, using fixed point arithmetic which compilers
+    // readily vectorize.
+    size_t pixelCount = static_cast<size_t>(width) * height;
+    captureStreamPlanes.resize(pixelCount * 3);
+    uint8_t *yPlane = captureStreamPlanes.data();
+    uint8_t *uPlane = yPlane + pixelCount;
+    uint8_t *vPlane = uPlane + pixelCount;
+
+    for (size_t i = 0; i < pixelCount; i++) {
+        int32_t r = frame.pixels[i * 4 + 0];
+        int32_t g = frame.pixels[i * 4 + 1];
+        int32_t b = frame.pixels[i * 4 + 2];
+        yPlane[i] = static_cast<uint8_t>(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+        uPlane[i] = static_cast<uint8_t>(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+        vPlane[i] = static_cast<uint8_t>(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+    }
+
+    writeY4mPlanes(stream, captureStreamPlanes);
+    captureStreamFrames++;
+}
+
+std::string getCaptureFilePath(uint64_t index, char const *extension)
+{
+    std::ostringstream filePath;
+    filePath << capturePath << "_" << std::setw(6) << std::setfill('0') << index << extension;
+    return filePath.str();
+}
+
+void writeCaptureFrame(CaptureFrame const &frame)
+{
+    TRACE_FUNCTION();
+
+    uint32_t width = swapchainExtent.width;
+    uint32_t height = swapchainExtent.height;
+
+    switch (captureFormat) {
+    case CaptureFormat::ePng:
+        writePng(getCaptureFilePath(frame.index, ".png"), width, height, frame.pixels);
+        break;
+    case CaptureFormat::eExr:
+        writeExr(getCaptureFilePath(frame.index, ".exr"), width, height, frame.pixels);
+        break;
+    case CaptureFormat::eY4m:
+        writeY4mFrame(captureStream, width, height, frame);
+        break;
+    default:
+        break;
+    }
+}
+
+void captureWorker(std::stop_token stopToken)
+{
+    TRACE_THREAD("capture");
+
+    while (true) {
+        CaptureFrame frame;
+        {
+            std::unique_lock lock(captureMutex);
+            captureCondition.wait(
+                lock, stopToken, [] { return !captureQueue.empty() || captureFinished; });
+            if (stopToken.stop_requested() || captureQueue.empty()) {
+                return;
+            }
+            frame = std::move(captureQueue.front());
+            captureQueue.pop_front();
+        }
+
+        try {
+            writeCaptureFrame(frame);
+        } catch (std::exception &error) {
+            std::cout << error.what() << std::endl;
+            std::lock_guard lock(captureMutex);
+            captureFailed = true;
+            captureQueue.clear();
+            return;
+        }
+
+        std::lock_guard lock(captureMutex);
+        capturePixelPool.push_back(std::move(frame.pixels));
+    }
+}
+
+void startCapture()
+{
+    TRACE_FUNCTION();
+
+    if (captureFormat == CaptureFormat::eNone) {
+        return;
+    }
+
+    if (captureFormat == CaptureFormat::eY4m) {
+        captureStream.open(capturePath, std::ios::binary);
+        if (!captureStream.is_open()) {
+            throw std::runtime_error("could not open file");
+        }
+        captureStream << "YUV4MPEG2 W" << swapchainExtent.width << " H" << swapchainExtent.height
+                      << " F" << CAPTURE_FRAME_RATE << ":1 Ip A1:1 C444\n";
+    }
+
+    captureThread = std::jthread(captureWorker);
+}
+
+// Copies a completed readback buffer out of mapped memory and hands it to the capture thread. The
+// frame is dropped if the capture thread has fallen too far behind.
+void collectReadback(uint32_t frame)
+{
+    TRACE_FUNCTION();
+
+    uint64_t index = *readbackFrames[frame];
+    readbackFrames[frame].reset();
+
+    // Video frames are placed on the constant rate stream by the time they were submitted. When
+    // rendering outpaces the stream, frames landing on a stream frame that has already been taken
+    // are skipped here, before they are copied out of mapped memory.
+    uint64_t streamFrame = 0;
+    if (captureFormat == CaptureFormat::eY4m) {
+        if (!captureStreamStart) {
+            captureStreamStart = readbackTimes[frame];
+        }
+
+        auto elapsedTime =
+            std::chrono::duration<double>(readbackTimes[frame] - *captureStreamStart).count();
+        streamFrame = static_cast<uint64_t>(std::llround(elapsedTime * CAPTURE_FRAME_RATE));
+        if (streamFrame < captureClaimedStreamFrames) {
+            return;
+        }
+    }
+
+    std::vector<uint8_t> pixels;
+    {
+        std::lock_guard lock(captureMutex);
+        if (captureFailed || captureQueue.size() >= MAX_QUEUED_CAPTURE_FRAMES) {
+            captureDroppedFrames++;
+            return;
+        }
+        if (!capturePixelPool.empty()) {
+            pixels = std::move(capturePixelPool.back());
+            capturePixelPool.pop_back();
+        }
+    }
+
+    if (!readbackCoherent) {
+        vk::MappedMemoryRange mappedMemoryRange{
+            .memory = *readbackMemories[frame],
+            .offset = 0,
+            .size = VK_WHOLE_SIZE,
+        };
+        device->invalidateMappedMemoryRanges(mappedMemoryRange);
+    }
+
+    pixels.resize(readbackSize);
+    convertPixels(readbackMappings[frame], pixels.data(), readbackSize / 4, captureSwizzle);
+
+    {
+        std::lock_guard lock(captureMutex);
+        captureQueue.push_back(CaptureFrame{
+            .index = index,
+            .streamFrame = streamFrame,
+            .pixels = std::move(pixels),
+        });
+    }
+    captureClaimedStreamFrames = streamFrame + 1;
+    captureCondition.notify_one();
+}
+
+void finishCapture()
+{
+    TRACE_FUNCTION();
+
+    if (captureFormat == CaptureFormat::eNone) {
+        return;
+    }
+
+    // Collect the remaining frames from oldest to newest, so the video stream stays in order.
+    for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+        uint32_t frame = (currentFrame + i) % MAX_FRAMES_IN_FLIGHT;
+        if (readbackFrames[frame]) {
+            collectReadback(frame);
+        }
+    }
+
+    {
+        std::lock_guard lock(captureMutex);
+        captureFinished = true;
+    }
+    captureCondition.notify_one();
+    captureThread.join();
+
+    captureStream.close();
+
+    if (captureDroppedFrames > 0) {
+        std::cout << "dropped " << captureDroppedFrames << " captured frames" << std::endl;
+    }
+}
+
+// Copies the upscaled swapchain image into the readback buffer of the frame, then transitions it
+// for presentation.
+void recordReadback(vk::CommandBuffer commandBuffer, uint32_t frame, uint32_t imageIndex)
+{
+    vk::ImageSubresourceRange subresourceRange{
+        .aspectMask = vk::ImageAspectFlagBits::eColor,
+        .baseMipLevel = 0,
+        .levelCount = 1,
+        .baseArrayLayer = 0,
+        .layerCount = 1,
+    };
+
+    vk::ImageMemoryBarrier transferBarrier{
+        .srcAccessMask = vk::AccessFlagBits::eTransferWrite,
+        .dstAccessMask = vk::AccessFlagBits::eTransferRead,
+        .oldLayout = vk::ImageLayout::eTransferDstOptimal,
+        .newLayout = vk::ImageLayout::eTransferSrcOptimal,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .image = swapchainImages[imageIndex],
+        .subresourceRange = subresourceRange,
+    };
+
+    commandBuffer.pipelineBarrier(
+        vk::PipelineStageFlagBits::eTransfer,
+        vk::PipelineStageFlagBits::eTransfer,
+        {},
+        nullptr,
+        nullptr,
+        transferBarrier);
+
+    vk::BufferImageCopy bufferImageCopy{
+        .bufferOffset = 0,
+        .bufferRowLength = 0,
+        .bufferImageHeight = 0,
+        .imageSubresource =
+            vk::ImageSubresourceLayers{
+                .aspectMask = vk::ImageAspectFlagBits::eColor,
+                .mipLevel = 0,
+                .baseArrayLayer = 0,
+                .layerCount = 1,
+            },
+        .imageOffset = {0, 0, 0},
+        .imageExtent = {swapchainExtent.width, swapchainExtent.height, 1},
+    };
+
+    commandBuffer.copyImageToBuffer(
+        swapchainImages[imageIndex],
+        vk::ImageLayout::eTransferSrcOptimal,
+        *readbackBuffers[frame],
+        bufferImageCopy);
+
+    vk::ImageMemoryBarrier presentBarrier{
+        .srcAccessMask = {},
+        .dstAccessMask = {},
+        .oldLayout = vk::ImageLayout::eTransferSrcOptimal,
+        .newLayout = vk::ImageLayout::ePresentSrcKHR,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .image = swapchainImages[imageIndex],
+        .subresourceRange = subresourceRange,
+    };
+
+    vk::BufferMemoryBarrier hostBarrier{
+        .srcAccessMask = vk::AccessFlagBits::eTransferWrite,
+        .dstAccessMask = vk::AccessFlagBits::eHostRead,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .buffer = *readbackBuffers[frame],
+        .offset = 0,
+        .size = VK_WHOLE_SIZE,
+    };
+
+    commandBuffer.pipelineBarrier(
+        vk::PipelineStageFlagBits::eTransfer,
+        vk::PipelineStageFlagBits::eHost | vk::PipelineStageFlagBits::eBottomOfPipe,
+        {},
+        nullptr,
+        hostBarrier,
+        presentBarrier);
+}
+
+vk::Extent2D getRenderExtent()
+{
+    return vk::Extent2D{
+        .width = std::max(
+            1u, static_cast<uint32_t>(std::lround(swapchainExtent.width * renderScale))),
+        .height = std::max(
+            1u, static_cast<uint32_t>(std::lround(swapchainExtent.height * renderScale))),
+    };
+}
+
+void recordCommandBuffer(uint32_t frame, uint32_t imageIndex)
+{
+    TRACE_FUNCTION();
+
+    auto commandBuffer = *commandBuffers[frame];
+    auto renderExtent = getRenderExtent();
+
+    vk::CommandBufferBeginInfo commandBufferBeginInfo{
+        .flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit,
+        //.pInheritanceInfo = nullptr,
+    };
+
+    commandBuffer.begin(commandBufferBeginInfo);
+
+    // Bottom of pipe timestamps are only written once all earlier commands have completed, so the
+    // scene interval doesn't include waiting for the previous frame to finish its upscale. The
+    // scene pass itself doesn't depend on the acquire semaphore, which is only waited on by the
+    // transfer stage.
+    uint32_t firstQuery = TIMESTAMPS_PER_FRAME * frame;
+    if (hasTimestamps) {
+        commandBuffer.resetQueryPool(*timestampQueryPool, firstQuery, TIMESTAMPS_PER_FRAME);
+        commandBuffer.writeTimestamp(
+            vk::PipelineStageFlagBits::eBottomOfPipe, *timestampQueryPool, firstQuery);
+    }
+
+    vk::ClearValue clearColor = vk::ClearValue{std::array<float, 4>{0.0f, 0.0f, 0.0f, 1.0f}};
+
+    vk::RenderPassBeginInfo renderPassBeginInfo{
+        .renderPass = *renderPass,
+        .framebuffer = *sceneFramebuffers[frame],
+        .renderArea =
+            vk::Rect2D{
+                .offset = {0, 0},
+                .extent = renderExtent,
+            },
+        .clearValueCount = 1,
+        .pClearValues = &clearColor,
+    };
+
+    vk::Viewport viewport{
+        .x = 0.0f,
+        .y = 0.0f,
+        .width = static_cast<float>(renderExtent.width),
+        .height = static_cast<float>(renderExtent.height),
+        .minDepth = 0.0f,
+        .maxDepth = 1.0f,
+    };
+
+    vk::Rect2D scissor{
+        .offset = {0, 0},
+        .extent = renderExtent,
+    };
+
+    commandBuffer.beginRenderPass(renderPassBeginInfo, vk::SubpassContents::eInline);
+    commandBuffer.bindPipeline(vk::PipelineBindPoint::eGraphics, *pipeline);
+    commandBuffer.setViewport(0, viewport);
+    commandBuffer.setScissor(0, scissor);
+    commandBuffer.draw(3, 1, 0, 0);
+    commandBuffer.endRenderPass();
+
+    if (hasTimestamps) {
+        commandBuffer.writeTimestamp(
+            vk::PipelineStageFlagBits::eBottomOfPipe, *timestampQueryPool, firstQuery + 1);
+    }
+
+    vk::ImageSubresourceRange subresourceRange{
+        .aspectMask = vk::ImageAspectFlagBits::eColor,
+        .baseMipLevel = 0,
+        .levelCount = 1,
+        .baseArrayLayer = 0,
+        .layerCount = 1,
+    };
+
+    vk::ImageMemoryBarrier blitBarrier{
+        //.srcAccessMask = {},
+        .dstAccessMask = vk::AccessFlagBits::eTransferWrite,
+        .oldLayout = vk::ImageLayout::eUndefined,
+        .newLayout = vk::ImageLayout::eTransferDstOptimal,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .image = swapchainImages[imageIndex],
+        .subresourceRange = subresourceRange,
+    };
+
+    commandBuffer.pipelineBarrier(
+        vk::PipelineStageFlagBits::eTransfer,
+        vk::PipelineStageFlagBits::eTransfer,
+        {},
+        nullptr,
+        nullptr,
+        blitBarrier);
+
+    // The barrier waits for the swapchain image to be acquired, so the upscale interval starts
+    // after it.
+    if (hasTimestamps) {
+        commandBuffer.writeTimestamp(
+            vk::PipelineStageFlagBits::eBottomOfPipe, *timestampQueryPool, firstQuery + 2);
+    }
+
+    // A linear filtered blit is the cheapest upscale available, and needs no extra pipeline.
+    vk::ImageSubresourceLayers subresourceLayers{
+        .aspectMask = vk::ImageAspectFlagBits::eColor,
+        .mipLevel = 0,
+        .baseArrayLayer = 0,
+        .layerCount = 1,
+    };
+
+    vk::ImageBlit imageBlit{
+        .srcSubresource = subresourceLayers,
+        .srcOffsets =
+            std::array<vk::Offset3D, 2>{
+                vk::Offset3D{0, 0, 0},
+                vk::Offset3D{
+                    static_cast<int32_t>(renderExtent.width),
+                    static_cast<int32_t>(renderExtent.height),
+                    1},
+            },
+        .dstSubresource = subresourceLayers,
+        .dstOffsets =
+            std::array<vk::Offset3D, 2>{
+                vk::Offset3D{0, 0, 0},
+                vk::Offset3D{
+                    static_cast<int32_t>(swapchainExtent.width),
+                    static_cast<int32_t>(swapchainExtent.height),
+                    1},
+            },
+    };
+
+    commandBuffer.blitImage(
+        *sceneImages[frame],
+        vk::ImageLayout::eTransferSrcOptimal,
+        swapchainImages[imageIndex],
+        vk::ImageLayout::eTransferDstOptimal,
+        imageBlit,
+        vk::Filter::eLinear);
+
+    // The upscale interval ends before the readback, so capturing doesn't lower the render scale.
+    if (hasTimestamps) {
+        commandBuffer.writeTimestamp(
+            vk::PipelineStageFlagBits::eBottomOfPipe, *timestampQueryPool, firstQuery + 3);
+    }
+
+    if (captureFormat != CaptureFormat::eNone) {
+        recordReadback(commandBuffer, frame, imageIndex);
+    } else {
+        vk::ImageMemoryBarrier presentBarrier{
+            .srcAccessMask = vk::AccessFlagBits::eTransferWrite,
+            //.dstAccessMask = {},
+            .oldLayout = vk::ImageLayout::eTransferDstOptimal,
+            .newLayout = vk::ImageLayout::ePresentSrcKHR,
+            .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .image = swapchainImages[imageIndex],
+            .subresourceRange = subresourceRange,
+        };
+
+        commandBuffer.pipelineBarrier(
+            vk::PipelineStageFlagBits::eTransfer,
+            vk::PipelineStageFlagBits::eBottomOfPipe,
+            {},
+            nullptr,
+            nullptr,
+            presentBarrier);
+    }
+
+
+    commandBuffer.end();
+}
+
+// Adjusts the render scale from the GPU time of a completed frame. The scale drops as soon as the
+// frame time rises above the upper threshold, but only rises once it has stayed below the lower
+// threshold for a while, so the scale doesn't oscillate around the budget.
+//
+// Completed frames lag up to MAX_FRAMES_IN_FLIGHT frames behind, so after the scale changes the
+// frames still recorded at the old scale are ignored. Otherwise a single spike would be corrected
+// again for every frame in flight.
+void updateRenderScale(uint32_t frame)
+{
+    TRACE_FUNCTION();
+
+    if (!hasTimestamps || !timestampFrames[frame]) {
+        return;
+    }
+
+    std::array<uint64_t, TIMESTAMPS_PER_FRAME> timestamps;
+    auto result = device->getQueryPoolResults(
+        *timestampQueryPool,
+        TIMESTAMPS_PER_FRAME * frame,
+        TIMESTAMPS_PER_FRAME,
+        sizeof(timestamps),
+        timestamps.data(),
+        sizeof(uint64_t),
+        vk::QueryResultFlagBits::e64);
+    if (result != vk::Result::eSuccess) {
+        return;
+    }
+
+#if defined(MINI_RENDERER_TRACE)
+    traceGpuFrame(timestamps);
+#endif
+
+    float sampleScale = timestampScales[frame];
+    if (sampleScale != renderScale) {
+        return;
+    }
+
+    double sceneTime = (timestamps[1] - timestamps[0]) * timestampPeriod / 1e6;
+    double upscaleTime = (timestamps[3] - timestamps[2]) * timestampPeriod / 1e6;
+    double frameTime = sceneTime + upscaleTime;
+    if (!gpuFrameTime || !gpuUpscaleTime) {
+        gpuFrameTime = frameTime;
+        gpuUpscaleTime = upscaleTime;
+    }
+    gpuFrameTime = *gpuFrameTime + FRAME_TIME_SMOOTHING * (frameTime - *gpuFrameTime);
+    gpuUpscaleTime = *gpuUpscaleTime + FRAME_TIME_SMOOTHING * (upscaleTime - *gpuUpscaleTime);
+
+    if (*gpuFrameTime > FRAME_TIME_LOW) {
+        framesUnderBudget = 0;
+    } else {
+        framesUnderBudget++;
+    }
+
+    bool isOverBudget = *gpuFrameTime > FRAME_TIME_HIGH;
+    bool isUnderBudget = framesUnderBudget >= RENDER_SCALE_INCREASE_DELAY;
+    if (!isOverBudget && !isUnderBudget) {
+        return;
+    }
+
+    // The scene time scales roughly with the pixel count, which is the square of the render scale,
+    // while the upscale always writes every swapchain pixel.
+    double targetFrameTime = 0.5 * (FRAME_TIME_HIGH + FRAME_TIME_LOW);
+    double targetSceneTime = std::max(targetFrameTime - *gpuUpscaleTime, 0.0);
+    double gpuSceneTime = std::max(*gpuFrameTime - *gpuUpscaleTime, 1e-3);
+    float targetScale =
+        sampleScale * static_cast<float>(std::sqrt(targetSceneTime / gpuSceneTime));
+    float nextScale = sampleScale + RENDER_SCALE_GAIN * (targetScale - sampleScale);
+    nextScale = std::clamp(nextScale, MIN_RENDER_SCALE, MAX_RENDER_SCALE);
+
+    framesUnderBudget = 0;
+
+    // The smoothed times only describe the old scale, so start again from the first new sample.
+    if (nextScale != renderScale) {
+        renderScale = nextScale;
+        gpuFrameTime.reset();
+        gpuUpscaleTime.reset();
+    }
 }
 
 void drawFrame()
 {
+    TRACE_FUNCTION();
+
+    {
+        TRACE_ZONE("waitForFences");
+        auto result = device->waitForFences(*inFlightFences[currentFrame], VK_TRUE, UINT64_MAX);
+        if (result != vk::Result::eSuccess) {
+            throw std::runtime_error("could not wait for frame fence");
+        }
+    }
+
+    // The fence also guarantees that the readback buffer and timestamps of this frame have been
+    // written.
+    if (readbackFrames.size() > 0 && readbackFrames[currentFrame]) {
+        collectReadback(currentFrame);
+    }
+
+    updateRenderScale(currentFrame);
+
     uint32_t imageIndex;
-    imageIndex = device->acquireNextImageKHR(*swapchain, UINT64_MAX, *imageAvailable, nullptr);
+    {
+        TRACE_ZONE("acquireNextImageKHR");
+        imageIndex = device->acquireNextImageKHR(
+            *swapchain, UINT64_MAX, *imageAvailableSemaphores[currentFrame], nullptr);
+    }
 
-    vk::PipelineStageFlags pipelineStateFlags{vk::PipelineStageFlagBits::eColorAttachmentOutput};
+    recordCommandBuffer(currentFrame, imageIndex);
+    if (captureFormat != CaptureFormat::eNone) {
+        readbackFrames[currentFrame] = frameIndex;
+        readbackTimes[currentFrame] = std::chrono::steady_clock::now();
+    }
+    if (hasTimestamps) {
+        timestampFrames[currentFrame] = true;
+        timestampScales[currentFrame] = renderScale;
+    }
+
+    // The swapchain image is first written by the blit, and the scene pass has no dependency on the
+    // transfer stage, so rendering the scene doesn't wait for the image to be acquired.
+    vk::PipelineStageFlags pipelineStateFlags{vk::PipelineStageFlagBits::eTransfer};
     vk::SubmitInfo submitInfo{
         .waitSemaphoreCount = 1,
-        .pWaitSemaphores = &*imageAvailable,
+        .pWaitSemaphores = &*imageAvailableSemaphores[currentFrame],
         .pWaitDstStageMask = &pipelineStateFlags,
         .commandBufferCount = 1,
-        .pCommandBuffers = &*commandBuffers[imageIndex],
+        .pCommandBuffers = &*commandBuffers[currentFrame],
         .signalSemaphoreCount = 1,
-        .pSignalSemaphores = &*renderFinished,
+        .pSignalSemaphores = &*renderFinishedSemaphores[currentFrame],
     };
 
-    queue.submit(submitInfo, nullptr);
+    {
+        TRACE_ZONE("submit");
+        device->resetFences(*inFlightFences[currentFrame]);
+        queue.submit(submitInfo, *inFlightFences[currentFrame]);
+    }
 
     vk::PresentInfoKHR presentInfo{
         .waitSemaphoreCount = 1,
-        .pWaitSemaphores = &*renderFinished,
+        .pWaitSemaphores = &*renderFinishedSemaphores[currentFrame],
         .swapchainCount = 1,
         .pSwapchains = &*swapchain,
         .pImageIndices = &imageIndex,
         //.pResults = nullptr,
     };
 
-    queue.presentKHR(presentInfo);
+    {
+        TRACE_ZONE("presentKHR");
+        queue.presentKHR(presentInfo);
+    }
 
-    queue.waitIdle();
+    currentFrame = (currentFrame + 1) % MAX_FRAMES_IN_FLIGHT;
+    frameIndex++;
 }
 
 void run()
 {
+    TRACE_THREAD("main");
+
     createWindow(APP_NAME, WIDTH, HEIGHT);
 
 #if (VULKAN_HPP_DISPATCH_LOADER_DYNAMIC == 1)
@@ -664,34 +1908,93 @@ void run()
     std::vector<char const *> deviceExtensions;
     deviceExtensions.push_back(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
 
+    std::vector<char const *> optionalDeviceExtensions;
+#if defined(MINI_RENDERER_TRACE)
+    optionalDeviceExtensions.push_back(VK_EXT_CALIBRATED_TIMESTAMPS_EXTENSION_NAME);
+#endif
+
     createInstance(APP_NAME, APP_VERSION, REQUIRED_VULKAN_VERSION, instanceExtensions);
     createSurface();
     choosePhysicalDevice();
     chooseQueueFamily();
-    createDevice(deviceExtensions);
+    createDevice(deviceExtensions, optionalDeviceExtensions);
     createSwapchain();
-    createImageViews();
+    createSceneImages();
     createRenderPass();
     createGraphicsPipeline();
     createFramebuffers();
     createCommandPool();
     createCommandBuffers();
-    createSemaphores();
+    createTimestampQueryPool();
+    createReadbackBuffers();
+    createSyncObjects();
+    startCapture();
 
     while (!glfwWindowShouldClose(window)) {
-        glfwPollEvents();
+        {
+            TRACE_ZONE("glfwPollEvents");
+            glfwPollEvents();
+        }
         drawFrame();
     }
 
     device->waitIdle();
 
+    finishCapture();
+
+#if defined(MINI_RENDERER_TRACE)
+    if (!tracePath.empty()) {
+        writeTrace(tracePath);
+    }
+#endif
+
     destroyWindow();
 }
 
-int main()
+void parseArguments(int argc, char *argv[])
+{
+    for (int i = 1; i < argc; i++) {
+        std::string argument = argv[i];
+
+        if (argument == "--capture" && i + 2 < argc) {
+            std::string format = argv[++i];
+            if (format == "png") {
+                captureFormat = CaptureFormat::ePng;
+            } else if (format == "exr") {
+                captureFormat = CaptureFormat::eExr;
+            } else if (format == "y4m") {
+                captureFormat = CaptureFormat::eY4m;
+            } else {
+                throw std::runtime_error("could not recognise capture format");
+            }
+            capturePath = argv[++i];
+            continue;
+        }
+
+#if defined(MINI_RENDERER_TRACE)
+        if (argument == "--trace" && i + 1 < argc) {
+            tracePath = argv[++i];
+            continue;
+        }
+
+        throw std::runtime_error(
+            "usage: MiniRenderer [--capture png|exr|y4m path] [--trace path]");
+#else
+        if (argument == "--trace") {
+            throw std::runtime_error(
+                "could not trace, build with MINI_RENDERER_TRACE to enable tracing");
+        }
+
+        throw std::runtime_error("usage: MiniRenderer [--capture png|exr|y4m path]");
+#endif
+    }
+}
+
+int main(int argc, char *argv[])
 {
     try {
         std::cout << "Mini Renderer" << std::endl;
+        parseArguments(argc, argv);
         run();
     } catch (std::exception &error) {
         std::cout << error.what() << std::endl;
@@ -0,0 +1,204 @@
+﻿#include "trace.hpp"
+
+#if defined(MINI_RENDERER_TRACE)
+
+#include <atomic>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+struct TraceEvent {
+    char const *name;
+    uint64_t begin;
+    uint64_t end;
+};
+
+// Only the owning thread writes events, and the event count is published after the event, so the
+// buffer can be read by another thread without a lock.
+struct TraceBuffer {
+    std::string threadName;
+    bool isGpu = false;
+    std::atomic<uint64_t> eventCount = 0;
+    std::vector<TraceEvent> events = std::vector<TraceEvent>(TRACE_BUFFER_SIZE);
+};
+
+struct TraceCalibration {
+    uint64_t clock;
+    uint64_t hostTime;
+};
+
+// The buffers are owned here rather than by their threads, so zones outlive the threads that
+// recorded them.
+std::mutex traceMutex;
+std::vector<std::unique_ptr<TraceBuffer>> traceBuffers;
+thread_local TraceBuffer *threadTraceBuffer = nullptr;
+TraceBuffer *gpuTraceBuffer = nullptr;
+TraceCalibration const traceStart{
+    .clock = readTraceClock(),
+    .hostTime = getTraceHostTime(),
+};
+
+uint64_t getTraceHostTime()
+{
+#if defined(_WIN32)
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+    return convertTraceHostTimestamp(static_cast<uint64_t>(counter.QuadPart));
+#else
+    timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return static_cast<uint64_t>(time.tv_sec) * 1000000000 + static_cast<uint64_t>(time.tv_nsec);
+#endif
+}
+
+uint64_t convertTraceHostTimestamp(uint64_t hostTimestamp)
+{
+#if defined(_WIN32)
+    static uint64_t const frequency = [] {
+        LARGE_INTEGER frequency;
+        QueryPerformanceFrequency(&frequency);
+        return static_cast<uint64_t>(frequency.QuadPart);
+    }();
+
+    // Split the conversion to avoid overflowing the intermediate product.
+    return hostTimestamp / frequency * 1000000000
+        + hostTimestamp % frequency * 1000000000 / frequency;
+#else
+    return hostTimestamp;
+#endif
+}
+
+TraceBuffer *createTraceBuffer()
+{
+    auto buffer = std::make_unique<TraceBuffer>();
+    auto bufferPointer = buffer.get();
+
+    std::lock_guard lock(traceMutex);
+    traceBuffers.push_back(std::move(buffer));
+
+    return bufferPointer;
+}
+
+void recordTraceEvent(TraceBuffer *buffer, char const *name, uint64_t begin, uint64_t end)
+{
+    uint64_t eventIndex = buffer->eventCount.load(std::memory_order_relaxed);
+    buffer->events[eventIndex % TRACE_BUFFER_SIZE] = TraceEvent{
+        .name = name,
+        .begin = begin,
+        .end = end,
+    };
+    buffer->eventCount.store(eventIndex + 1, std::memory_order_release);
+}
+
+void recordTraceZone(char const *name, uint64_t begin, uint64_t end)
+{
+    if (!threadTraceBuffer) {
+        threadTraceBuffer = createTraceBuffer();
+    }
+
+    recordTraceEvent(threadTraceBuffer, name, begin, end);
+}
+
+void recordTraceGpuZone(char const *name, uint64_t begin, uint64_t end)
+{
+    if (!gpuTraceBuffer) {
+        gpuTraceBuffer = createTraceBuffer();
+
+        std::lock_guard lock(traceMutex);
+        gpuTraceBuffer->threadName = "GPU";
+        gpuTraceBuffer->isGpu = true;
+    }
+
+    recordTraceEvent(gpuTraceBuffer, name, begin, end);
+}
+
+void setTraceThreadName(char const *name)
+{
+    if (!threadTraceBuffer) {
+        threadTraceBuffer = createTraceBuffer();
+    }
+
+    std::lock_guard lock(traceMutex);
+    threadTraceBuffer->threadName = name;
+}
+
+void writeTrace(std::string const &filePath)
+{
+    // The raw clock is assumed to be linear, so it is mapped to the host clock using the samples
+    // taken at the start of the program and now.
+    TraceCalibration traceEnd{
+        .clock = readTraceClock(),
+        .hostTime = getTraceHostTime(),
+    };
+
+    double hostTimePerClock = static_cast<double>(traceEnd.hostTime - traceStart.hostTime)
+        / static_cast<double>(traceEnd.clock - traceStart.clock);
+
+    auto convertClock = [&](uint64_t clock) {
+        auto elapsedClock = static_cast<int64_t>(clock - traceStart.clock);
+        return static_cast<double>(elapsedClock) * hostTimePerClock;
+    };
+
+    auto convertHostTime = [&](uint64_t hostTime) {
+        return static_cast<double>(static_cast<int64_t>(hostTime - traceStart.hostTime));
+    };
+
+    std::ofstream file(filePath);
+    if (!file.is_open()) {
+        throw std::runtime_error("could not open file");
+    }
+
+    // Chrome trace timestamps are in microseconds.
+    file << std::fixed << std::setprecision(3);
+    file << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+
+    std::lock_guard lock(traceMutex);
+
+    bool isFirstEvent = true;
+    auto beginEvent = [&]() {
+        if (!isFirstEvent) {
+            file << ",\n";
+        }
+        isFirstEvent = false;
+    };
+
+    for (size_t i = 0; i < traceBuffers.size(); i++) {
+        auto const &buffer = *traceBuffers[i];
+        size_t threadId = i + 1;
+
+        if (!buffer.threadName.empty()) {
+            beginEvent();
+            file << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << threadId
+                 << ",\"args\":{\"name\":\"" << buffer.threadName << "\"}}";
+        }
+
+        uint64_t eventCount = buffer.eventCount.load(std::memory_order_acquire);
+        uint64_t firstEvent = eventCount > TRACE_BUFFER_SIZE ? eventCount - TRACE_BUFFER_SIZE : 0;
+        for (uint64_t j = firstEvent; j < eventCount; j++) {
+            auto const &event = buffer.events[j % TRACE_BUFFER_SIZE];
+
+            double begin = buffer.isGpu ? convertHostTime(event.begin) : convertClock(event.begin);
+            double end = buffer.isGpu ? convertHostTime(event.end) : convertClock(event.end);
+
+            beginEvent();
+            file << "{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":"
+                 << threadId << ",\"ts\":" << begin / 1000.0 << ",\"dur\":" << (end - begin) / 1000.0
+                 << "}";
+        }
+    }
+
+    file << "\n]}\n";
+}
+
+#endif
@@ -0,0 +1,81 @@
+﻿#ifndef MINI_RENDERER_TRACE_H
+#define MINI_RENDERER_TRACE_H
+
+// Scoped CPU zones are recorded into a ring buffer owned by the recording thread, so recording
+// never takes a lock. Everything here compiles out unless MINI_RENDERER_TRACE is defined.
+
+#if defined(MINI_RENDERER_TRACE)
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+#if defined(_M_X64)
+#include <intrin.h>
+#elif defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+// Each thread keeps the most recent zones, older zones are overwritten.
+size_t const TRACE_BUFFER_SIZE = 1 << 16;
+
+// Returns a raw timestamp, which is converted to the trace timeline when the trace is written.
+inline uint64_t readTraceClock()
+{
+#if defined(_M_X64) || defined(__x86_64__)
+    return __rdtsc();
+#else
+    return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+// Returns the host clock that Vulkan calibrates against, in nanoseconds. This is the trace
+// timeline.
+uint64_t getTraceHostTime();
+
+// Converts a timestamp from the Vulkan host time domain of this platform to nanoseconds.
+uint64_t convertTraceHostTimestamp(uint64_t hostTimestamp);
+
+// The name must be a string literal, or otherwise outlive the trace.
+void recordTraceZone(char const *name, uint64_t begin, uint64_t end);
+
+// Records a zone on the GPU track, in nanoseconds on the trace timeline. This must only be called
+// from one thread.
+void recordTraceGpuZone(char const *name, uint64_t begin, uint64_t end);
+
+void setTraceThreadName(char const *name);
+
+// Writes every recorded zone in the Chrome trace event format, which can also be opened in
+// Perfetto.
+void writeTrace(std::string const &filePath);
+
+struct TraceZone {
+    char const *name;
+    uint64_t begin;
+
+    explicit TraceZone(char const *name) : name(name), begin(readTraceClock()) {}
+
+    ~TraceZone()
+    {
+        recordTraceZone(name, begin, readTraceClock());
+    }
+
+    TraceZone(TraceZone const &) = delete;
+    TraceZone &operator=(TraceZone const &) = delete;
+};
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+#define TRACE_ZONE(name) TraceZone TRACE_CONCAT(traceZone, __LINE__)(name)
+#define TRACE_FUNCTION() TRACE_ZONE(__func__)
+#define TRACE_THREAD(name) setTraceThreadName(name)
+
+#else
+
+#define TRACE_ZONE(name)
+#define TRACE_FUNCTION()
+#define TRACE_THREAD(name)
+
+#endif
+
+#endif